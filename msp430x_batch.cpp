@@ -0,0 +1,138 @@
+/*
+ * Batch runner: simulates many independent firmware images or test vectors
+ * in one process, one msp430x processor per job, on a work-stealing thread
+ * pool.
+ *
+ * Link this file instead of ArchC's generated main.cpp. Processors are
+ * driven by their behavior() loop directly, without starting the SystemC
+ * kernel, which only works for the functional (untimed) simulator.
+ *
+ * Usage: msp430x_batch [-j threads] [-f jobs] [firmware.elf ...]
+ *   Each firmware image on the command line is one job. Each line of the
+ *   jobs file is the command line of one job, as given to the simulator
+ *   (e.g. "--load=test.elf vector3.bin").
+ */
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <stdlib.h>
+
+#include "msp430x.H"
+#include "msp430x_batch.H"
+
+typedef std::vector<std::string> args_t;
+
+static int run_job(const args_t &args, size_t index)
+{
+    std::string name = "msp430x_" + std::to_string(index);
+
+    std::vector<char *> argv;
+    argv.push_back(const_cast<char *>(name.c_str()));
+    for(size_t i = 0; i < args.size(); ++i)
+        argv.push_back(const_cast<char *>(args[i].c_str()));
+    argv.push_back(NULL);
+
+    std::unique_ptr<msp430x> proc;
+    {
+        std::lock_guard<std::mutex> guard(processor_lock());
+        proc.reset(new msp430x(name.c_str()));
+        proc->init(argv.size() - 1, argv.data());
+    }
+
+    proc->behavior();
+    int status = proc->ac_exit_status;
+
+    std::lock_guard<std::mutex> guard(processor_lock());
+    proc.reset();
+    return status;
+}
+
+static void usage(const char *self)
+{
+    std::cerr << "Usage: " << self << " [-j threads] [-f jobs] [firmware.elf ...]"
+              << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int threads = std::thread::hardware_concurrency();
+    std::vector<args_t> jobs;
+
+    for(int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if(arg == "-j" && i + 1 < argc)
+            threads = atoi(argv[++i]);
+        else if(arg == "-f" && i + 1 < argc)
+        {
+            std::ifstream file(argv[++i]);
+            if(!file)
+            {
+                std::cerr << "Cannot open " << argv[i] << std::endl;
+                return 1;
+            }
+
+            std::string line;
+            while(std::getline(file, line))
+            {
+                std::istringstream words(line);
+                args_t args;
+                std::string word;
+                while(words >> word)
+                    args.push_back(word);
+                if(!args.empty())
+                    jobs.push_back(args);
+            }
+        }
+        else if(arg[0] == '-')
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        else
+            jobs.push_back(args_t(1, "--load=" + arg));
+    }
+
+    if(!threads)
+        threads = 1;
+
+    if(jobs.empty())
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    batch_pool_t pool(threads);
+    for(size_t i = 0; i < jobs.size(); ++i)
+    {
+        const args_t &args = jobs[i];
+        pool.submit([&args, i]() { return run_job(args, i); });
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<int> statuses = pool.run();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    int failed = 0;
+    for(size_t i = 0; i < statuses.size(); ++i)
+    {
+        if(statuses[i])
+        {
+            ++failed;
+            std::cerr << "job " << i << ":";
+            for(size_t j = 0; j < jobs[i].size(); ++j)
+                std::cerr << " " << jobs[i][j];
+            std::cerr << ": exit status " << statuses[i] << std::endl;
+        }
+    }
+
+    std::cerr << jobs.size() << " jobs, " << failed << " failed, "
+              << elapsed.count() << " s on " << threads << " threads" << std::endl;
+    return failed ? 1 : 0;
+}
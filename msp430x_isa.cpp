@@ -1,347 +1,1017 @@
+#include <atomic>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string.h>
 
 #include  "msp430x_isa.H"
 #include  "msp430x_isa_init.cpp"
 #include  "msp430x_bhv_macros.H"
+#include  "msp430x_core.H"
+#include  "msp430x_net.H"
+#ifdef MSP430X_JIT
+#include  "msp430x_jit.H"
+#endif
 
-#define REG_PC  0
-#define REG_SP  1
-#define REG_SR  2
-#define REG_CG1 REG_SR
-#define REG_CG2 3
+// Maximum number of instructions run from the decode cache for a single
+// instruction decoded by ArchC.
+#define DECODE_CACHE_BUDGET 256
+
+#define TRACE_DEFAULT_FILE "msp430x.trace"
+#define PROFILE_DEFAULT_FILE "msp430x.profile"
 
 //!'using namespace' statement to allow access to all msp430x-specific datatypes
 using namespace msp430x_parms;
 
-struct sr_flags_t
+typedef msp430x_isa::core_t core_t;
+
+static std::atomic<unsigned int> processors_started(0);
+
+// Running cores by DM port
+static std::mutex cores_lock;
+static std::map<const void *, core_t *> cores;
+
+core_t* core_t::of(const void *dm)
 {
-    // Never write to those fields firectly. Reading is fine.
-    unsigned int V, SCG1, SCG0, OSCOFF, CPUOFF, GIE, N, Z, C;
-    ac_regbank<16, msp430x_parms::ac_word, msp430x_parms::ac_Dword>& RB;
+    std::lock_guard<std::mutex> guard(cores_lock);
+    std::map<const void *, core_t *>::const_iterator i = cores.find(dm);
+    return (i == cores.end()) ? NULL : i->second;
+}
 
-    sr_flags_t(
-        ac_regbank<16, msp430x_parms::ac_word, msp430x_parms::ac_Dword>& RB):
-        RB(RB)
-    {
-        uint16_t sr = RB[REG_SR];
-        V      = ((sr >> 8) & 1);
-        SCG1   = ((sr >> 7) & 1);
-        SCG0   = ((sr >> 6) & 1);
-        OSCOFF = ((sr >> 5) & 1);
-        CPUOFF = ((sr >> 4) & 1);
-        GIE    = ((sr >> 3) & 1);
-        N      = ((sr >> 2) & 1);
-        Z      = ((sr >> 1) & 1);
-        C      = ((sr     ) & 1);
-    }
+enum addressing_mode_e
+{
+    AM_REGISTER = 0,
+    AM_INDEXED = 1,
+    AM_INDIRECT_REG = 2,
+    AM_INDIRECT_INCR = 3
+};
 
-    void set_V(unsigned int value)
-    {
-        V = (value ? 1 : 0);
-        update_register();
-    }
+#define TRACE_DOUBLEOP(id) \
+    do { \
+        TRACE_SET(core->trace, instr, (id)); \
+        TRACE_SET(core->trace, aux, as | (ad << 2) | (bw << 3) | (1 << 8)); \
+    } while(0)
+
+#define TRACE_SIMPLEOP(id) \
+    do { \
+        TRACE_SET(core->trace, instr, (id)); \
+        TRACE_SET(core->trace, aux, ad | (bw << 2)); \
+    } while(0)
+
+// Diagnostics go through the asynchronous log, with the cycle and the PC of
+// the instruction.
+static void log_event(core_t &core, log_kind_e kind, uint32_t pc)
+{
+    core.log.push(kind, core.timeline.now, pc);
+}
 
-    void set_N(unsigned int value)
+static int16_t u10_to_i16(uint16_t u10)
+{
+    uint16_t tmp = (u10 & 0x01ff);
+    if(u10 & (1 << 9))
+        tmp |= 0xfe00;
+    return tmp;
+}
+
+static void mem_write(core_t &core, uint32_t address, uint16_t value)
+{
+    core.decode_cache.invalidate(address);
+    core.DM.write(address, value);
+}
+
+static void mem_write_byte(core_t &core, uint32_t address, uint8_t value)
+{
+    core.decode_cache.invalidate(address);
+    core.DM.write_byte(address, value);
+}
+
+// Pushes n words at once: words[0] ends up on top of the stack.
+static void stack_push(core_t &core, const uint16_t *words, unsigned int n)
+{
+    core.RB[REG_SP] -= 2 * n;
+    core.decode_cache.invalidate_span(core.RB[REG_SP], 2 * n);
+    core.memory.write_words(core.RB[REG_SP], words, n);
+}
+
+// Pops n words at once: words[0] comes from the top of the stack.
+static void stack_pop(core_t &core, uint16_t *words, unsigned int n)
+{
+    core.memory.read_words(words, core.RB[REG_SP], n);
+    core.RB[REG_SP] += 2 * n;
+}
+
+// Operand handlers, instantiated for every combination of addressing mode,
+// width and register class so that the common cases (e.g. register to
+// register) compile down to straight-line code. The mode is the index given
+// by source_mode() or dest_mode().
+
+typedef uint16_t (*source_handler_t)(core_t &core, uint16_t rsrc);
+
+typedef uint16_t (*dest_operand_handler_t)(core_t &core, uint16_t rdst);
+
+typedef void (*dest_handler_t)(core_t &core, uint16_t operand, uint16_t rdst);
+
+template<unsigned int MODE>
+static uint16_t source_operand(core_t &core, uint16_t rsrc)
+{
+    const unsigned int AS = MODE & 0x3;
+    const unsigned int BW = (MODE >> 2) & 0x1;
+    const unsigned int RC = MODE >> 3;
+    uint16_t operand;
+
+    if(AS == AM_REGISTER)
     {
-        N = (value ? 1 : 0);
-        update_register();
+        if(RC == RC_CG2)
+            operand = 0;
+        else
+        {
+            if(RC == RC_SR)
+                core.flags.sync(core.RB);
+            operand = core.RB[rsrc];
+            if(BW)
+                operand &= 0xff;
+        }
     }
-
-    void set_Z(unsigned int value)
+    else if(AS == AM_INDEXED)
     {
-        Z = (value ? 1 : 0);
-        update_register();
+        if(RC == RC_CG2)
+            operand = 0x1;
+        else
+        {
+            uint16_t x = core.DM.read(core.RB[REG_PC]);
+            TRACE_SET(core.trace, src_addr, x);
+            TRACE_FLAG(core.trace, TRACE_SRC_MEM);
+            if(BW)
+                operand = core.DM.read_byte(x);
+            else
+                operand = core.DM.read(x);
+            core.RB[REG_PC] += 2;
+        }
     }
-
-    void set_C(unsigned int value)
+    else if(AS == AM_INDIRECT_REG)
     {
-        C = (value ? 1 : 0);
-        update_register();
+        if(RC == RC_CG2)
+            operand = 0x2;
+        else if(RC == RC_SR)
+            operand = 0x4;
+        else if(BW)
+            operand = core.DM.read_byte(core.RB[rsrc]);
+        else
+            operand = core.DM.read(core.RB[rsrc]);
     }
-
-    void set_GIE(unsigned int value)
+    else // AM_INDIRECT_INCR
     {
-        GIE = (value ? 1 : 0);
-        update_register();
+        if(RC == RC_CG2)
+            operand = 0xffff;
+        else if(RC == RC_SR)
+            operand = 0x8;
+        else
+        {
+            operand = core.DM.read(core.RB[rsrc]);
+            // /!\ Here, pc may change if rsrc==0, which is the expected behavior
+            // TODO: 20bit address mode?
+            if(RC == RC_PC || !BW)
+                core.RB[rsrc] += 2;
+            else
+                core.RB[rsrc] += 1;
+        }
     }
 
-    void update_register(void)
+    TRACE_SET(core.trace, src, operand);
+    TRACE_FLAG(core.trace, TRACE_HAS_SRC);
+    return operand;
+}
+
+template<unsigned int MODE>
+static uint16_t dest_operand(core_t &core, uint16_t rdst)
+{
+    const unsigned int AD = MODE & 0x1;
+    const unsigned int BW = (MODE >> 1) & 0x1;
+    const unsigned int RC = MODE >> 2;
+
+    if(AD == AM_REGISTER)
     {
-        RB[REG_SR] = (V      << 8)
-                   | (SCG1   << 7)
-                   | (SCG0   << 6)
-                   | (OSCOFF << 5)
-                   | (CPUOFF << 4)
-                   | (GIE    << 3)
-                   | (N      << 2)
-                   | (Z      << 1)
-                   | (C          );
+        if(RC == RC_SR)
+            core.flags.sync(core.RB);
+        return BW ? core.RB[rdst] & 0xff : core.RB[rdst];
     }
-};
 
-enum extension_state_e
-{
-    EXT_NONE,
-    EXT_RDY,
-    EXT_RUN,
-    EXT_ERROR
-};
+    uint16_t x = core.DM.read(core.RB[REG_PC]);
+    if(BW)
+        return core.DM.read_byte(x);
+    return core.DM.read(x);
+}
 
-struct extension_t
+template<unsigned int MODE>
+static void dest(core_t &core, uint16_t operand, uint16_t rdst)
 {
-    uint16_t payload_h, payload_l, al;
-    extension_state_e state;
+    const unsigned int AD = MODE & 0x1;
+    const unsigned int BW = (MODE >> 1) & 0x1;
+    const unsigned int RC = MODE >> 2;
 
-    extension_t():
-        state(EXT_NONE)
+    TRACE_SET(core.trace, result, operand);
+
+    if(AD == AM_REGISTER)
     {
+        TRACE_SET(core.trace, dst_addr, rdst);
+        TRACE_FLAG(core.trace, TRACE_DST_REG);
+        // Byte instructions clear the high byte of a register.
+        core.RB[rdst] = BW ? operand & 0xff : operand;
+        if(RC == RC_SR)
+            core.flags.discard();
     }
-
-    void tick()
+    else
     {
-        if(state == EXT_RDY)
-            state = EXT_RUN;
-        else if(state == EXT_RUN)
-        {
-            state = EXT_ERROR;
-            std::cerr << "Extension state error (Oops)" << std::endl;
-        }
+        uint16_t x = core.DM.read(core.RB[REG_PC]);
+        TRACE_SET(core.trace, dst_addr, x);
+        TRACE_FLAG(core.trace, TRACE_DST_MEM);
+        if(BW)
+            mem_write_byte(core, x, operand);
+        else
+            mem_write(core, x, operand);
+        core.RB[REG_PC] += 2;
     }
+}
+
+#define HANDLERS_4(handler, base) \
+    handler<(base)>, handler<(base) + 1>, handler<(base) + 2>, handler<(base) + 3>
+
+#define HANDLERS_16(handler, base) \
+    HANDLERS_4(handler, (base)),     HANDLERS_4(handler, (base) + 4), \
+    HANDLERS_4(handler, (base) + 8), HANDLERS_4(handler, (base) + 12)
+
+static const source_handler_t source_handlers[32] =
+{
+    HANDLERS_16(source_operand, 0), HANDLERS_16(source_operand, 16)
 };
 
-union alu_value_u
+static const dest_operand_handler_t dest_operand_handlers[16] =
 {
-    uint16_t u;
-    int16_t i;
+    HANDLERS_16(dest_operand, 0)
 };
 
-enum addressing_mode_e
+static const dest_handler_t dest_handlers[16] =
 {
-    AM_REGISTER = 0,
-    AM_INDEXED = 1,
-    AM_INDIRECT_REG = 2,
-    AM_INDIRECT_INCR = 3,
-    AM_INVALID
+    HANDLERS_16(dest, 0)
 };
 
-static extension_t extension;
+// The handlers of the instruction running, picked once when it was
+// decoded.
+static inline uint16_t doubleop_source(core_t &core, uint16_t rsrc)
+{
+    return source_handlers[core.src_mode](core, rsrc);
+}
 
-static unsigned int negative16(uint16_t x)
+static inline uint16_t doubleop_dest_operand(core_t &core, uint16_t rdst)
 {
-    return x >> 15;
+    return dest_operand_handlers[core.dst_mode](core, rdst);
 }
 
-static unsigned int negative8(uint8_t x)
+static inline void doubleop_dest(core_t &core, uint16_t operand, uint16_t rdst)
 {
-    return x >> 7;
+    dest_handlers[core.dst_mode](core, operand, rdst);
 }
 
-static unsigned int carry16(uint32_t x)
+static void extension_to_repeat(
+    const extension_t &extension,
+    ac_regbank<16, msp430x_parms::ac_word, msp430x_parms::ac_Dword>& RB,
+    uint16_t &zc,
+    uint16_t &al,
+    uint16_t &count)
 {
-    return x & (1 << 16);
+    zc = (extension.payload_h >> 1) & 1;
+    al = extension.al;
+
+    if(extension.payload_h & 1) // #
+    {
+        uint16_t rn = extension.payload_l & 0xf;
+        count = 1 + (RB[rn] & 0xf);
+    }
+    else
+        count = 1 + (extension.payload_l & 0xf);
 }
 
-static unsigned int carry8(uint32_t x)
+// Number of times the current instruction runs: 1 unless an extension word
+// asks for a repetition, which is only allowed in register mode. Consumes
+// the extension word.
+static uint16_t repeat_count(core_t &core, bool register_mode, uint16_t &zc)
 {
-    return x & (1 << 8);
+    uint16_t al;
+    uint16_t count = 1;
+
+    zc = 0;
+    if(core.extension.state != EXT_RUN)
+        return 1;
+
+    if(register_mode)
+        extension_to_repeat(core.extension, core.RB, zc, al, count);
+    else
+        log_event(core, LOG_EXT_MODE, core.ac_pc - 2);
+    core.extension.state = EXT_NONE;
+
+    // Each repetition of a register-mode instruction takes one cycle.
+    if(core.timed)
+        core.timeline.now += count - 1;
+
+    TRACE_SET(core.trace, aux, (core.trace.current().aux & 0xff) | (count << 8));
+    return count;
 }
 
-static unsigned int overflow16(uint16_t op1, uint16_t op2, uint16_t result)
+// Result of an iteration of a repeated instruction, as the next one sees
+// it: byte instructions only keep the low byte.
+static inline uint16_t truncate(uint32_t x, uint16_t bw)
 {
-    return (~(op1 ^ op2) & (result ^ op1)) >> 15;
+    return bw ? x & 0xff : x & 0xffff;
 }
 
-static unsigned int overflow8(uint8_t op1, uint8_t op2, uint8_t result)
+// Source operand of the next iteration of a repeated instruction whose
+// source and destination are the same register.
+static inline uint16_t same_register_source(uint16_t operand_dst, uint16_t bw)
 {
-    return (~(op1 ^ op2) & (result ^ op1)) >> 7;
+    return truncate(operand_dst, bw);
 }
 
-static int16_t u10_to_i16(uint16_t u10)
+// Rotates the low "bits" bits of x right by n.
+static inline uint32_t rotate_right(uint32_t x, unsigned int n, unsigned int bits)
 {
-    uint16_t tmp = (u10 & 0x01ff);
-    if(u10 & (1 << 9))
-        tmp |= 0xfe00;
-    return tmp;
+    n %= bits;
+    if(!n)
+        return x;
+    return ((x >> n) | (x << (bits - n))) & ((1 << bits) - 1);
 }
 
-static uint16_t doubleop_source(
-    ac_memport<msp430x_parms::ac_word, msp430x_parms::ac_Hword>& DM,
-    ac_regbank<16, msp430x_parms::ac_word, msp430x_parms::ac_Dword>& RB,
-    uint16_t as, uint16_t bw, uint16_t rsrc)
+// Operand of a single operand instruction. Sets address to the memory
+// location the result goes back to, or to -1 for a register.
+static uint16_t singleop_operand(
+    core_t &core,
+    uint16_t ad, uint16_t bw, uint16_t rdst,
+    uint32_t &address)
 {
-    uint16_t operand;
+    address = -1;
 
-    switch(as)
+    switch(ad)
     {
         case AM_REGISTER:
-            if(rsrc == REG_CG2)
-                operand = 0;
-            else
-            {
-                operand = RB[rsrc];
-                if(bw)
-                    operand &= 0xff;
-            }
-            break;
+            if(rdst == REG_SR)
+                core.flags.sync(core.RB);
+            return bw ? core.RB[rdst] & 0xff : core.RB[rdst];
 
         case AM_INDEXED:
-            if(rsrc == REG_CG2)
-                operand = 0x1;
-            /*
-            else if(rsrc == REG_CG1)
-            {
-                operand = DM.read(RB[rsrc]);
-                std::cerr << "Oops As=1, src=r2" << std::endl;
-            }
-            */
-            else
-            {
-                uint16_t x = DM.read(RB[REG_PC]);
-                std::cout << "@" << std::hex << x << std::endl;
-                if(bw)
-                    operand = DM.read_byte(x);
-                else
-                    operand = DM.read(x);
-                RB[REG_PC] += 2;
-            }
+        {
+            // x(Rn); x(PC) is relative to the index word, and x(SR) is &x.
+            uint16_t x = core.memory.read_word(core.RB[REG_PC]);
+            uint16_t base = (rdst == REG_SR) ? 0 : core.RB[rdst];
+            address = (uint16_t)(base + x);
+            core.RB[REG_PC] += 2;
             break;
+        }
 
         case AM_INDIRECT_REG:
-            if(rsrc == REG_CG2)
-                operand = 0x2;
-            else if(rsrc == REG_CG1)
-                operand = 0x4;
-            else
-            {
-                if(bw)
-                    operand = DM.read_byte(RB[rsrc]);
-                else
-                    operand = DM.read(RB[rsrc]);
-            }
+            address = core.RB[rdst];
             break;
 
         case AM_INDIRECT_INCR:
-            if(rsrc == REG_CG2)
-                operand = 0xffff;
-            else if(rsrc == REG_CG1)
-                operand = 0x8;
-            else
-            {
-                operand = DM.read(RB[rsrc]);
-                // /!\ Here, pc may change if rsrc==0, which is the expected behavior
-                // TODO: 20bit address mode?
-                if(rsrc == REG_PC || !bw)
-                    RB[rsrc] += 2;
-                else
-                    RB[rsrc] += 1;
-            }
+            address = core.RB[rdst];
+            core.RB[rdst] += (bw && rdst != REG_PC) ? 1 : 2;
             break;
+    }
 
-        default:
-            // Oops
-            break;
+    TRACE_SET(core.trace, src_addr, address);
+    TRACE_FLAG(core.trace, TRACE_SRC_MEM);
+    return bw ? core.memory.read_byte(address) : core.memory.read_word(address);
+}
+
+static void singleop_write(
+    core_t &core,
+    uint16_t bw, uint16_t rdst, uint32_t address,
+    uint16_t result)
+{
+    TRACE_SET(core.trace, result, result);
+
+    if(address == (uint32_t)-1)
+    {
+        TRACE_SET(core.trace, dst_addr, rdst);
+        TRACE_FLAG(core.trace, TRACE_DST_REG);
+        core.RB[rdst] = result;
+        if(rdst == REG_SR)
+            core.flags.discard();
     }
+    else
+    {
+        TRACE_SET(core.trace, dst_addr, address);
+        TRACE_FLAG(core.trace, TRACE_DST_MEM);
+        if(bw)
+            mem_write_byte(core, address, result);
+        else
+            mem_write(core, address, result);
+    }
+}
 
-    return operand;
+// Highest priority interrupt the CPU accepts now, -1 if none.
+static inline int interrupt_ready(const core_t &core)
+{
+    if(!core.interrupts.pending)
+        return -1;
+    return core.interrupts.next(core.RB[REG_SR] & SR_GIE);
 }
 
-static uint16_t doubleop_dest_operand(
-    ac_memport<msp430x_parms::ac_word, msp430x_parms::ac_Hword>& DM,
-    ac_regbank<16, msp430x_parms::ac_word, msp430x_parms::ac_Dword>& RB,
-    uint16_t ad, uint16_t bw, uint16_t rdst)
+// Pushes PC then SR the way CALL pushes its return address, clears SR but
+// SCG0 (which also wakes the CPU up) and jumps to the handler.
+static void enter_interrupt(core_t &core, unsigned int slot)
 {
-    switch(ad)
+    core.flags.sync(core.RB);
+    core.interrupts.clear(slot);
+    ++core.interrupts.accepted;
+    if(core.timed)
+        core.timeline.now += INTERRUPT_CYCLES;
+
+    uint16_t frame[2] = {(uint16_t)core.RB[REG_SR], (uint16_t)core.ac_pc};
+    stack_push(core, frame, 2);
+
+    core.RB[REG_SR] = core.RB[REG_SR] & SR_SCG0;
+    core.RB[REG_PC] = core.DM.read(interrupts_t::vector_address(slot));
+    core.ac_pc = core.RB[REG_PC];
+    PROFILE_CALL(core.profile, core.ac_pc, core.RB[REG_SP]);
+}
+
+// Lets simulated time run until an event clears CPUOFF or raises an
+// interrupt the CPU accepts, without fetching instructions. Returns false
+// if the CPU is off with nothing left to wake it up.
+static bool low_power_wait(core_t &core)
+{
+    while((core.RB[REG_SR] & SR_CPUOFF) && interrupt_ready(core) < 0)
     {
-        case AM_REGISTER:
-            return RB[rdst];
+        if(!core.timeline.pending())
+            return false;
+        core.timeline.warp();
+    }
+    return true;
+}
 
-        case AM_INDEXED:
-        {
-            uint16_t x = DM.read(RB[REG_PC]);
-            if(bw)
-                return DM.read_byte(x);
-            else
-                return DM.read(x);
-        }
+// Does the work of the C library routine at "target" on the host, if it is
+// an intrinsic, and charges what the guest code would have taken. The CALL
+// then goes on at its return address. False if the guest code has to run.
+static bool call_intrinsic(core_t &core, uint32_t target)
+{
+    int which = core.intrinsics.lookup(target);
+    if(which < 0)
+        return false;
+
+    uint16_t result;
+    uint32_t length;
+    if(!core.intrinsics.run(which, core.memory, core.decode_cache,
+                            core.RB[12], core.RB[13], core.RB[14], result, length))
+        return false;
+
+    core.RB[12] = result;
+    uint64_t instructions = core.intrinsics.instructions(which, length);
+    core.instructions += instructions;
+    core.timeline.now += core.timed ? core.intrinsics.cycles(which, length) : instructions;
+    return true;
+}
 
-        default:
-            // Oops
-            break;
+// A loop made of a jump back to itself, or of a jump back to a BIT or CMP
+// right before it, only reads memory and sets flags: nothing changes its
+// outcome until an event runs or an interrupt is accepted, since devices
+// only change their registers and raise interrupts from events. Called
+// once the jump at "jump_pc" went back to "target", skips the iterations
+// that would end before the next event and charges them as if they had
+// run. Time stays on an iteration boundary before the event, so the last
+// iterations run as usual.
+static void skip_idle_loop(core_t &core, uint32_t jump_pc, uint32_t target)
+{
+    if(target > jump_pc || jump_pc - target > 6)
+        return;
+    uint64_t next = core.timeline.next();
+    if(next == timeline_t::NEVER || interrupt_ready(core) >= 0)
+        return;
+
+    // Cycles of the jump and of the BIT or CMP, if any
+    unsigned int jump_cycles = core.timed ? JUMP_CYCLES : 1, test_cycles = 0;
+    unsigned int instructions = 1;
+    if(target != jump_pc)
+    {
+        // @Rn+ would move through memory.
+        const decoded_t &d = core.decode_cache.lookup(core.DM, target);
+        if((d.id != INSTR_BIT && d.id != INSTR_CMP) || target + d.length != jump_pc
+           || operand_class(d.field[4], d.field[1]) == OC_INCREMENT)
+            return;
+        test_cycles = core.timed ? d.cycles : 1;
+        ++instructions;
+    }
+    unsigned int cycles = jump_cycles + test_cycles;
+
+    // An event may have run between the BIT and the jump: only skip once a
+    // whole iteration ran without any, i.e. the next event did not change.
+    if(core.idle_jump != jump_pc || core.idle_next != next)
+    {
+        core.idle_jump = jump_pc;
+        core.idle_next = next;
+        return;
     }
-    return -1;
+    if(next <= core.timeline.now)
+        return;
+
+    // Not past the next change of sampling mode either
+    uint64_t iterations = (next - core.timeline.now - 1) / cycles;
+    if(core.sampler.next_switch > core.instructions
+       && iterations > (core.sampler.next_switch - core.instructions) / instructions)
+        iterations = (core.sampler.next_switch - core.instructions) / instructions;
+    if(!iterations)
+        return;
+
+    // The profile sees the skipped runs of the jump and of the BIT or CMP
+    // where they belong, as sampling sees them in core_t::instructions.
+    if(test_cycles)
+        PROFILE_SKIPPED(core.profile, target, iterations, iterations * test_cycles);
+    PROFILE_SKIPPED(core.profile, jump_pc, iterations, iterations * jump_cycles);
+    core.timeline.now += iterations * cycles;
+    core.instructions += iterations * instructions;
+    ++core.idle_skips;
+    core.idle_cycles += iterations * cycles;
 }
 
-static void doubleop_dest(
-    ac_memport<msp430x_parms::ac_word, msp430x_parms::ac_Hword>& DM,
-    ac_regbank<16, msp430x_parms::ac_word, msp430x_parms::ac_Dword>& RB,
-    uint16_t operand,
-    uint16_t ad, uint16_t bw, uint16_t rdst)
+// Taken jump: moves PC by "offset" words, from the next instruction.
+// begin_instruction() already moved PC past the jump, a single word, so
+// the target is jump + 2 + 2 * offset as the ISA defines it.
+static void take_jump(core_t &core, uint16_t offset)
 {
-    std::cout << " -> ";
+    uint32_t jump_pc = core.RB[REG_PC] - 2;
+    int16_t signed_offset = 2 * u10_to_i16(offset);
+    core.RB[REG_PC] += signed_offset;
+    skip_idle_loop(core, jump_pc, core.RB[REG_PC]);
+}
 
-    switch(ad)
+#ifdef MSP430X_FUZZ
+// Writes the next input and lets the fuzz target see it.
+static void fuzz_start(core_t &core)
+{
+    fuzz_t &fuzz = core.fuzz;
+    const fuzz_t::input_t &input = fuzz.next_input();
+    core.memory.write_span(fuzz.input_address, input.data(), input.size());
+    core.decode_cache.invalidate_span(fuzz.input_address, input.size());
+    core.RB[12] = fuzz.input_address;
+    core.RB[13] = input.size();
+    fuzz.started = core.timeline.now;
+}
+
+// Takes the snapshot at the entry PC; ends the execution at the stop PC,
+// over budget or asleep for good, and starts the next one from the
+// snapshot. Returns true if the instruction ArchC decoded must not run.
+static bool fuzz_step(core_t &core)
+{
+    fuzz_t &fuzz = core.fuzz;
+    if(fuzz.state == FUZZ_BOOT && core.ac_pc == fuzz.entry)
     {
-        case AM_REGISTER:
-            std::cout << "r" << std::dec << rdst;
-            RB[rdst] = operand;
-            break;
+        core.snapshot();
+        fuzz.state = FUZZ_RUN;
+        fuzz_start(core);
+        return false;
+    }
+    if(fuzz.state != FUZZ_RUN)
+        return false;
 
-        case AM_INDEXED:
-        {
-            uint16_t x = DM.read(RB[REG_PC]);
-            std::cout << std::hex << x;
-            if(bw)
-                DM.write_byte(x, operand);
-            else
-                DM.write(x, operand);
-            RB[REG_PC] += 2;
-            break;
-        }
+    bool hang = core.timeline.now - fuzz.started >= fuzz.budget;
+    bool asleep = (core.RB[REG_SR] & SR_CPUOFF) && !core.timeline.pending()
+                  && interrupt_ready(core) < 0;
+    if(core.ac_pc != fuzz.stop && !hang && !asleep)
+        return false;
 
-        default:
-            // Oops
-            break;
+    if(!fuzz.finish(hang))
+    {
+        fuzz.state = FUZZ_DONE;
+        return true;
     }
+    core.restore();
+    fuzz_start(core);
+    return true;
+}
+#endif
 
-    std::cout << std::endl;
+// "d" is the decoded_t or decode_entry_t of the instruction at ac_pc.
+template<typename entry_t>
+static void begin_instruction(core_t &core, const entry_t &d)
+{
+    unsigned int cycles = d.cycles;
+    core.src_mode = d.src_mode;
+    core.dst_mode = d.dst_mode;
+    if(!core.extension.tick())
+        log_event(core, LOG_EXT_UNUSED, core.ac_pc);
+    PROFILE_INSTRUCTION(core.profile, core.ac_pc, core.timeline.now);
+    core.timeline.now += core.timed ? cycles : 1;
+    ++core.instructions;
+
+    TRACE_BEGIN(core.trace, core.ac_pc, core.DM.read(core.ac_pc),
+                core.RB[REG_SP], core.flags.value(core.RB));
+    if(core.extension.state == EXT_RUN)
+        TRACE_FLAG(core.trace, TRACE_EXTENDED);
+
+    core.ac_pc += 2;
+    core.RB[REG_PC] = core.ac_pc;
 }
 
-static void extension_to_repeat(
-    const extension_t &extension,
-    ac_regbank<16, msp430x_parms::ac_word, msp430x_parms::ac_Dword>& RB,
-    uint16_t &zc,
-    uint16_t &al,
-    uint16_t &count)
+#define DISPATCH_DOUBLEOP(name) \
+    case INSTR_##name: \
+        _behavior_msp430x_##name(d.field[0], d.field[1], d.field[2], \
+                                 d.field[3], d.field[4], d.field[5]); \
+        break
+
+// Type_SimpleOp, Type_PushPopM and Type_Extension all have four fields.
+#define DISPATCH_SIMPLEOP(name) \
+    case INSTR_##name: \
+        _behavior_msp430x_##name(d.field[0], d.field[1], d.field[2], d.field[3]); \
+        break
+
+#define DISPATCH_JUMP(name) \
+    case INSTR_##name: \
+        _behavior_msp430x_##name(d.field[0], d.field[1], d.field[2]); \
+        break
+
+// Direct-threaded dispatch (MSP430X_THREADED): fetches the next instruction
+// and jumps to its handler, under the same conditions as the switch-based
+// loop. Handlers run the behavior and check the same exit conditions.
+#define THREAD_DISPATCH() \
+    do { \
+        if(executed >= DECODE_CACHE_BUDGET || FUZZ_WATCH(core->fuzz, ac_pc)) \
+            goto thread_stop; \
+        if(core->timeline.due()) \
+            core->timeline.run_due(); \
+        if(interrupt_ready(*core) >= 0) \
+            goto thread_stop; \
+        d = &core->decode_cache.lookup(DM, ac_pc); \
+        if(!d->handler) \
+            d->handler = thread_handlers[d->id]; \
+        next_pc = ac_pc + d->length; \
+        goto *d->handler; \
+    } while(0)
+
+#define THREAD_BEGIN(name) \
+    thread_##name: \
+        begin_instruction(*core, *d); \
+        ++executed
+
+#define THREAD_DOUBLEOP(name) \
+    THREAD_BEGIN(name); \
+    _behavior_msp430x_##name(d->field[0], d->field[1], d->field[2], \
+                             d->field[3], d->field[4], d->field[5]); \
+    if(ac_pc != next_pc || (RB[REG_SR] & SR_CPUOFF)) \
+        goto thread_stop; \
+    THREAD_DISPATCH()
+
+#define THREAD_SIMPLEOP(name) \
+    THREAD_BEGIN(name); \
+    _behavior_msp430x_##name(d->field[0], d->field[1], d->field[2], d->field[3]); \
+    if(ac_pc != next_pc || (RB[REG_SR] & SR_CPUOFF)) \
+        goto thread_stop; \
+    THREAD_DISPATCH()
+
+// CALL and RETI always leave the loop.
+#define THREAD_LEAVE(name) \
+    THREAD_BEGIN(name); \
+    _behavior_msp430x_##name(d->field[0], d->field[1], d->field[2], d->field[3]); \
+    goto thread_stop
+
+#ifdef MSP430X_JIT
+#define THREAD_TAKEN_JUMP() \
+    if(ac_pc != next_pc && core->jit->hot(ac_pc)) \
+        goto thread_stop
+#else
+#define THREAD_TAKEN_JUMP() \
+    do {} while(0)
+#endif
+
+#define THREAD_JUMP(name) \
+    THREAD_BEGIN(name); \
+    _behavior_msp430x_##name(d->field[0], d->field[1], d->field[2]); \
+    THREAD_TAKEN_JUMP(); \
+    THREAD_DISPATCH()
+
+//!Behavior executed before simulation begins.
+void ac_behavior( begin )
 {
-    zc = (extension.payload_h >> 1) & 1;
-    al = extension.al;
+    core = new core_t(DM, RB, ac_pc, processors_started++);
+
+    // From now on, DM is backed by the sparse store.
+    core->memory.load_from(DM);
+    DM.set_storage(core->memory);
 
-    if(extension.payload_h & 1) // #
     {
-        uint16_t rn = extension.payload_l & 0xf;
-        count = 1 + (RB[rn] & 0xf);
+        std::lock_guard<std::mutex> guard(cores_lock);
+        cores[&DM] = core;
     }
-    else
-        count = 1 + (extension.payload_l & 0xf);
+
+    // Fast functional mode: one cycle per instruction, whatever it does.
+    const char *timing = getenv("MSP430X_TIMING");
+    if(timing && !strcmp(timing, "functional"))
+        core->timed = false;
+
+    // Sampled simulation starts in functional mode.
+    if(core->sampler.configure())
+        core->timed = false;
+
+    // C library string routines run on the host.
+    core->intrinsics.configure();
+
+#ifdef MSP430X_JIT
+    core->jit = new jit_t(*core);
+#endif
+
+#ifdef MSP430X_TRACE
+    // Processors after the first one get a numbered trace file.
+    const char *path = getenv("MSP430X_TRACE_FILE");
+    std::string name(path ? path : TRACE_DEFAULT_FILE);
+    if(core->id)
+        name += "." + std::to_string(core->id);
+    if(!core->trace.open(name.c_str()))
+        std::cerr << "Cannot open trace file " << name << " (Oops)" << std::endl;
+#endif
+
+#ifdef MSP430X_FUZZ
+    core->fuzz.configure();
+#endif
+
+    core->log.configure(core->id);
+
+    // Started by the network runner on behalf of a node
+    core->net = net_node_t::current();
+    if(core->net)
+        core->net->attach(*core);
 }
 
-//!Behavior executed before simulation begins.
-void ac_behavior( begin ){}
+#ifdef MSP430X_PROFILE
+static void write_profile(core_t &core)
+{
+    const char *path = getenv("MSP430X_PROFILE_FILE");
+    std::string name(path ? path : PROFILE_DEFAULT_FILE);
+    if(core.id)
+        name += "." + std::to_string(core.id);
+    core.profile.write(name.c_str(), core.timeline.now, getenv("MSP430X_PROFILE_ELF"));
+}
+#endif
 
 //!Behavior executed after simulation ends.
-void ac_behavior( end ){}
+void ac_behavior( end )
+{
+    core->flags.sync(RB);
+    TRACE_CLOSE(core->trace);
+    core->log.close();
+
+    std::cerr << "Cycles: " << std::dec << core->timeline.now << " ("
+              << (core->sampler.enabled() ? "sampled, " : core->timed ? "timed, " : "functional, ")
+              << core->timeline.skipped << " in low-power mode, "
+              << core->timeline.wakeups << " wake-ups)" << std::endl;
+    std::cerr << "Instructions: " << core->instructions << std::endl;
+    if(core->sampler.enabled())
+        core->sampler.report(std::cerr, core->instructions);
+    std::cerr << "Interrupts: " << core->interrupts.accepted << std::endl;
+    if(core->log.logged || core->log.dropped)
+        std::cerr << "Log: " << core->log.logged << " records, "
+                  << core->log.dropped << " dropped, "
+                  << core->log.waits << " waits" << std::endl;
+    if(core->idle_skips)
+        std::cerr << "Idle loops: " << core->idle_skips << " skips, "
+                  << core->idle_cycles << " cycles" << std::endl;
+    if(core->intrinsics.enabled())
+        std::cerr << "Intrinsics: " << core->intrinsics.calls << " calls, "
+                  << core->intrinsics.bytes << " bytes" << std::endl;
+#ifdef MSP430X_JIT
+    std::cerr << "JIT: " << core->jit->translated << " blocks translated, "
+              << core->jit->flushes << " flushes" << std::endl;
+    delete core->jit;
+#endif
+#ifdef MSP430X_FUZZ
+    if(core->fuzz.state != FUZZ_OFF)
+        std::cerr << "Fuzz: " << core->fuzz.execs << " executions, "
+                  << core->fuzz.edges << " edges, "
+                  << core->fuzz.corpus.size() << " inputs in corpus, "
+                  << core->fuzz.hangs << " hangs" << std::endl;
+#endif
+#ifdef MSP430X_PROFILE
+    write_profile(*core);
+#endif
+    if(core->net)
+    {
+        std::cerr << "Net: node " << core->net->id << ", "
+                  << core->net->sent << " frames sent, "
+                  << core->net->received << " received, "
+                  << core->net->dropped << " dropped, "
+                  << core->net->waits << " waits" << std::endl;
+        core->net->detach();
+    }
+    std::cerr << "DM: " << core->memory.resident_pages() << " resident pages ("
+              << core->memory.resident_pages() * paged_memory_t::PAGE_SIZE / 1024 << " KiB)"
+              << std::endl;
+
+    {
+        std::lock_guard<std::mutex> guard(cores_lock);
+        cores.erase(&DM);
+    }
+
+    // DM still refers to the sparse store, which goes away with the core.
+    delete core;
+    core = NULL;
+}
 
 //!Generic instruction behavior method.
 void ac_behavior( instruction )
 {
-    extension.tick();
+#ifdef MSP430X_FUZZ
+    // Executions restart from the snapshot, not at the decoded instruction.
+    if(core->fuzz.state != FUZZ_OFF && fuzz_step(*core))
+    {
+        if(core->fuzz.state == FUZZ_DONE)
+            stop();
+        ac_annul();
+        return;
+    }
+#endif
 
-    std::cout << std::endl;
-    std::cout << "pc=" << std::hex << ac_pc << std::endl;
-    std::cout << "sp=" << std::hex << RB[REG_SP] << std::endl;
+    // Sampled simulation changes modes between two instruction behaviors.
+    if(core->sampler.due(core->instructions))
+        core->timed = core->sampler.advance(core->instructions,
+                                            core->timeline.now - core->timeline.skipped);
 
-    ac_pc += 2;
-    RB[REG_PC] = ac_pc;
+    if(core->timeline.due())
+        core->timeline.run_due();
+
+    if((RB[REG_SR] & SR_CPUOFF) && !low_power_wait(*core))
+    {
+        log_event(*core, LOG_CPU_OFF, ac_pc);
+        stop();
+        ac_annul();
+        return;
+    }
+
+    // The handler starts at the next instruction behavior, since ArchC
+    // already decoded the one at the interrupted PC.
+    int slot = interrupt_ready(*core);
+    if(slot >= 0)
+    {
+        enter_interrupt(*core, slot);
+        ac_annul();
+        return;
+    }
+
+#ifdef MSP430X_JIT
+    // Translated code runs until the next event or the next change of
+    // sampling mode at most (an instruction takes a cycle or more), and
+    // not at all in sampling windows.
+    if(!core->sampler.detailed() && core->jit->hot(ac_pc))
+    {
+        uint64_t budget = core->timeline.next() - core->timeline.now;
+        if(budget > core->sampler.next_switch - core->instructions)
+            budget = core->sampler.next_switch - core->instructions;
+        unsigned int elapsed = core->jit->run(budget < JIT_BUDGET ? budget : JIT_BUDGET);
+        if(elapsed)
+        {
+            core->timeline.now += elapsed;
+            ac_annul();
+            return;
+        }
+    }
+#endif
+
+#ifndef MSP430X_NO_DECODE_CACHE
+    // Run from the decode cache, starting with this very instruction, until
+    // the control flow leaves the block (jumps do not) or the budget is
+    // spent. ArchC's own decoding of the current instruction is then
+    // annulled.
+    unsigned int executed = 0;
+#ifdef MSP430X_THREADED
+    // Same loop as below, but each handler dispatches the next instruction
+    // itself, so that the host predicts each dispatch branch on its own.
+    // Labels in instr_id_e order
+    static void *const thread_handlers[] =
+    {
+        &&thread_stop, &&thread_stop, // INSTR_EMPTY, INSTR_INVALID
+        &&thread_MOV, &&thread_ADD, &&thread_ADDC, &&thread_SUBC, &&thread_SUB,
+        &&thread_CMP, &&thread_DADD, &&thread_BIT, &&thread_BIC, &&thread_BIS,
+        &&thread_XOR, &&thread_AND,
+        &&thread_RRC, &&thread_SWPB, &&thread_RRA, &&thread_SXT, &&thread_PUSH,
+        &&thread_CALL, &&thread_RETI,
+        &&thread_JNZ, &&thread_JZ, &&thread_JNC, &&thread_JC, &&thread_JN,
+        &&thread_JGE, &&thread_JL, &&thread_JMP,
+        &&thread_PUSHPOPM, &&thread_EXT
+    };
+    decoded_t *d;
+    uint32_t next_pc;
+
+    THREAD_DISPATCH();
+
+    THREAD_DOUBLEOP(MOV);
+    THREAD_DOUBLEOP(ADD);
+    THREAD_DOUBLEOP(ADDC);
+    THREAD_DOUBLEOP(SUBC);
+    THREAD_DOUBLEOP(SUB);
+    THREAD_DOUBLEOP(CMP);
+    THREAD_DOUBLEOP(DADD);
+    THREAD_DOUBLEOP(BIT);
+    THREAD_DOUBLEOP(BIC);
+    THREAD_DOUBLEOP(BIS);
+    THREAD_DOUBLEOP(XOR);
+    THREAD_DOUBLEOP(AND);
+    THREAD_SIMPLEOP(RRC);
+    THREAD_SIMPLEOP(SWPB);
+    THREAD_SIMPLEOP(RRA);
+    THREAD_SIMPLEOP(SXT);
+    THREAD_SIMPLEOP(PUSH);
+    THREAD_LEAVE(CALL);
+    THREAD_LEAVE(RETI);
+    THREAD_SIMPLEOP(PUSHPOPM);
+    THREAD_SIMPLEOP(EXT);
+    THREAD_JUMP(JNZ);
+    THREAD_JUMP(JZ);
+    THREAD_JUMP(JNC);
+    THREAD_JUMP(JC);
+    THREAD_JUMP(JN);
+    THREAD_JUMP(JGE);
+    THREAD_JUMP(JL);
+    THREAD_JUMP(JMP);
+
+thread_stop:
+#else
+    while(executed < DECODE_CACHE_BUDGET)
+    {
+        if(core->timeline.due())
+            core->timeline.run_due();
+        if(interrupt_ready(*core) >= 0)
+            break;
+
+        const decoded_t &d = core->decode_cache.lookup(DM, ac_pc);
+        if(d.id == INSTR_INVALID)
+            break;
+
+        // d may be invalidated by the instruction itself.
+        uint8_t id = d.id;
+        uint32_t next_pc = ac_pc + d.length;
+        bool jump = false;
+
+        begin_instruction(*core, d);
+        ++executed;
+
+        switch(d.id)
+        {
+            DISPATCH_DOUBLEOP(MOV);
+            DISPATCH_DOUBLEOP(ADD);
+            DISPATCH_DOUBLEOP(ADDC);
+            DISPATCH_DOUBLEOP(SUBC);
+            DISPATCH_DOUBLEOP(SUB);
+            DISPATCH_DOUBLEOP(CMP);
+            DISPATCH_DOUBLEOP(DADD);
+            DISPATCH_DOUBLEOP(BIT);
+            DISPATCH_DOUBLEOP(BIC);
+            DISPATCH_DOUBLEOP(BIS);
+            DISPATCH_DOUBLEOP(XOR);
+            DISPATCH_DOUBLEOP(AND);
+            DISPATCH_SIMPLEOP(RRC);
+            DISPATCH_SIMPLEOP(SWPB);
+            DISPATCH_SIMPLEOP(RRA);
+            DISPATCH_SIMPLEOP(SXT);
+            DISPATCH_SIMPLEOP(PUSH);
+            DISPATCH_SIMPLEOP(CALL);
+            DISPATCH_SIMPLEOP(RETI);
+            DISPATCH_SIMPLEOP(PUSHPOPM);
+            DISPATCH_SIMPLEOP(EXT);
+
+            default:
+                jump = true;
+                switch(d.id)
+                {
+                    DISPATCH_JUMP(JNZ);
+                    DISPATCH_JUMP(JZ);
+                    DISPATCH_JUMP(JNC);
+                    DISPATCH_JUMP(JC);
+                    DISPATCH_JUMP(JN);
+                    DISPATCH_JUMP(JGE);
+                    DISPATCH_JUMP(JL);
+                    DISPATCH_JUMP(JMP);
+                }
+                break;
+        }
+
+        // CALL and RETI may land on a syscall, which ArchC must see. Entering
+        // a low-power mode is handled by the next instruction behavior.
+        if(id == INSTR_CALL || id == INSTR_RETI || (!jump && ac_pc != next_pc)
+           || (RB[REG_SR] & SR_CPUOFF) || FUZZ_WATCH(core->fuzz, ac_pc))
+            break;
+
+#ifdef MSP430X_JIT
+        // Taken jumps start blocks; leave to the JIT once there is code.
+        if(jump && ac_pc != next_pc && core->jit->hot(ac_pc))
+            break;
+#endif
+    }
+#endif
+
+    if(executed)
+    {
+        ac_annul();
+        return;
+    }
+#endif
+
+    begin_instruction(*core, word_entry(DM.read(ac_pc)));
 }
  
 //! Instruction Format behavior methods.
@@ -354,454 +1024,538 @@ void ac_behavior( Type_Extension ){}
 //!Instruction MOV behavior method.
 void ac_behavior( MOV )
 {
-    std::cout << "MOV" << std::endl
-              << " " << std::dec << "as=" << (int)as << std::endl
-              << " " << "ad=" << (int)ad << std::endl;
-
-    uint16_t operand = doubleop_source(DM, RB, as, bw, rsrc);
+    TRACE_DOUBLEOP(TRACE_MOV);
 
-    std::cout << std::hex << operand;
+    // Repeating a move changes nothing.
+    uint16_t zc;
+    repeat_count(*core, as == AM_REGISTER && ad == AM_REGISTER, zc);
 
-    doubleop_dest(DM, RB, operand, ad, bw, rdst);
+    uint16_t operand = doubleop_source(*core, rsrc);
+    doubleop_dest(*core, operand, rdst);
     ac_pc = RB[REG_PC];
+
+    // RET is MOV @SP+,PC.
+    if(rdst == REG_PC && ad == AM_REGISTER)
+        PROFILE_UNWIND(core->profile, RB[REG_SP]);
 }
 
 //!Instruction ADD behavior method.
 void ac_behavior( ADD )
 {
-    uint16_t zc = 0;
-    uint16_t al = 1;
-    uint16_t count = 1;
+    TRACE_DOUBLEOP(TRACE_ADD);
 
-    if(extension.state == EXT_RUN)
-    {
-        std::cout << "Extended ADD" << std::endl;
+    uint16_t zc;
+    uint16_t count = repeat_count(*core, as == AM_REGISTER && ad == AM_REGISTER, zc);
+
+    uint16_t operand_src = doubleop_source(*core, rsrc);
+    uint16_t operand_dst = doubleop_dest_operand(*core, rdst);
 
-        if(as == 0 && ad == 0)
+    // All iterations but the last one, which sets the flags
+    if(count > 1)
+    {
+        if(rsrc == rdst)
         {
-            extension_to_repeat(extension, RB, zc, al, count);
-            std::cout << " " << std::dec << count << " times" << std::endl;
+            operand_dst = truncate(operand_dst << (count - 1), bw);
+            operand_src = same_register_source(operand_dst, bw);
         }
         else
-            std::cerr << "Oops, extension not supported yet." << std::endl;
+            operand_dst = truncate(operand_dst + (count - 1) * operand_src, bw);
     }
 
-    uint16_t operand_src = doubleop_source(DM, RB, as, bw, rsrc);
-    uint16_t operand_dst = doubleop_dest_operand(DM, RB, ad, bw, rdst);
     uint16_t operand_tmp = operand_dst;
-    sr_flags_t sr(RB);
-
-    for(size_t i = count; i--; )
-        operand_dst += operand_src;
-
-    sr.set_Z(operand_dst == 0);
-    if(bw)
-    {
-        sr.set_N(negative8(operand_dst));
-        sr.set_V(overflow8(operand_src, operand_tmp, operand_dst));
-    }
-    else
-    {
-        sr.set_N(negative16(operand_dst));
-        sr.set_V(overflow16(operand_src, operand_tmp, operand_dst));
-    }
+    operand_dst += operand_src;
 
     uint32_t promoted_src = operand_src;
     uint32_t promoted_dst = operand_tmp;
     uint32_t promoted_result = promoted_src + promoted_dst;
-    if(bw)
-        sr.set_C(carry8(promoted_result));
-    else
-        sr.set_C(carry16(promoted_result));
+    core->flags.record(FLAGS_ARITH, bw, operand_src, operand_tmp, operand_dst, promoted_result);
 
-    doubleop_dest(DM, RB, operand_dst, ad, bw, rdst);
+    doubleop_dest(*core, operand_dst, rdst);
     ac_pc = RB[REG_PC];
-    extension.state = EXT_NONE;
 }
 
 //!Instruction ADDC behavior method.
 void ac_behavior( ADDC )
 {
-    uint16_t operand_src = doubleop_source(DM, RB, as, bw, rsrc);
-    uint16_t operand_dst = doubleop_dest_operand(DM, RB, ad, bw, rdst);
-    uint16_t operand_tmp = operand_dst;
-    sr_flags_t sr(RB);
+    TRACE_DOUBLEOP(TRACE_ADDC);
 
-    operand_dst += operand_src + sr.C;
+    uint16_t zc;
+    uint16_t count = repeat_count(*core, as == AM_REGISTER && ad == AM_REGISTER, zc);
 
-    sr.set_Z(operand_dst == 0);
-    if(bw)
-    {
-        sr.set_N(negative8(operand_dst));
-        sr.set_V(overflow8(operand_src, operand_tmp, operand_dst));
-    }
-    else
+    uint16_t operand_src = doubleop_source(*core, rsrc);
+    uint16_t operand_dst = doubleop_dest_operand(*core, rdst);
+    unsigned int carry = zc ? 0 : core->flags.C(RB);
+
+    // All iterations but the last one, which sets the flags. The carry
+    // chains them: at most 15 of them.
+    for(uint16_t i = count; --i; )
     {
-        sr.set_N(negative16(operand_dst));
-        sr.set_V(overflow16(operand_src, operand_tmp, operand_dst));
+        uint32_t sum = operand_src + carry + operand_dst;
+        operand_dst = truncate(sum, bw);
+        carry = (zc || !(bw ? carry8(sum) : carry16(sum))) ? 0 : 1;
+        if(rsrc == rdst)
+            operand_src = same_register_source(operand_dst, bw);
     }
 
-    uint32_t promoted_src = operand_src + sr.C;
+    uint16_t operand_tmp = operand_dst;
+
+    operand_dst += operand_src + carry;
+
+    uint32_t promoted_src = operand_src + carry;
     uint32_t promoted_dst = operand_tmp;
     uint32_t promoted_result = promoted_src + promoted_dst;
-    if(bw)
-        sr.set_C(carry8(promoted_result));
-    else
-        sr.set_C(carry16(promoted_result));
+    core->flags.record(FLAGS_ARITH, bw, operand_src, operand_tmp, operand_dst, promoted_result);
 
-    doubleop_dest(DM, RB, operand_dst, ad, bw, rdst);
+    doubleop_dest(*core, operand_dst, rdst);
     ac_pc = RB[REG_PC];
 }
 
 //!Instruction SUB behavior method.
 void ac_behavior( SUB )
 {
-    uint16_t operand_src = doubleop_source(DM, RB, as, bw, rsrc);
-    uint16_t operand_dst = doubleop_dest_operand(DM, RB, ad, bw, rdst);
-    uint16_t operand_tmp = operand_dst;
-    sr_flags_t sr(RB);
+    TRACE_DOUBLEOP(TRACE_SUB);
 
-    operand_dst += ~operand_src + 1;
+    uint16_t zc;
+    uint16_t count = repeat_count(*core, as == AM_REGISTER && ad == AM_REGISTER, zc);
 
-    sr.set_Z(operand_dst == 0);
-    if(bw)
-    {
-        sr.set_N(negative8(operand_dst));
-        sr.set_V(overflow8(operand_src, operand_tmp, operand_dst));
-    }
-    else
+    uint16_t operand_src = doubleop_source(*core, rsrc);
+    uint16_t operand_dst = doubleop_dest_operand(*core, rdst);
+
+    // All iterations but the last one, which sets the flags
+    if(count > 1)
     {
-        sr.set_N(negative16(operand_dst));
-        sr.set_V(overflow16(operand_src, operand_tmp, operand_dst));
+        if(rsrc == rdst)
+            operand_dst = operand_src = 0;
+        else
+            operand_dst -= (count - 1) * operand_src;
     }
 
+    uint16_t operand_tmp = operand_dst;
+
+    operand_dst += ~operand_src + 1;
+
     uint32_t promoted_src = ~operand_src + 1;
     uint32_t promoted_dst = operand_tmp;
     uint32_t promoted_result = promoted_src + promoted_dst;
-    if(bw)
-        sr.set_C(carry8(promoted_result));
-    else
-        sr.set_C(carry16(promoted_result));
+    core->flags.record(FLAGS_ARITH, bw, operand_src, operand_tmp, operand_dst, promoted_result);
 
-    doubleop_dest(DM, RB, operand_dst, ad, bw, rdst);
+    doubleop_dest(*core, operand_dst, rdst);
     ac_pc = RB[REG_PC];
 }
 
 //!Instruction SUBC behavior method.
 void ac_behavior( SUBC )
 {
-    uint16_t operand_src = doubleop_source(DM, RB, as, bw, rsrc);
-    uint16_t operand_dst = doubleop_dest_operand(DM, RB, ad, bw, rdst);
-    uint16_t operand_tmp = operand_dst;
-    sr_flags_t sr(RB);
+    TRACE_DOUBLEOP(TRACE_SUBC);
 
-    operand_dst += ~operand_src + sr.C;
+    uint16_t zc;
+    uint16_t count = repeat_count(*core, as == AM_REGISTER && ad == AM_REGISTER, zc);
 
-    sr.set_Z(operand_dst == 0);
-    if(bw)
-    {
-        sr.set_N(negative8(operand_dst));
-        sr.set_V(overflow8(operand_src, operand_tmp, operand_dst));
-    }
-    else
+    uint16_t operand_src = doubleop_source(*core, rsrc);
+    uint16_t operand_dst = doubleop_dest_operand(*core, rdst);
+    unsigned int carry = zc ? 0 : core->flags.C(RB);
+
+    // All iterations but the last one, which sets the flags. The carry
+    // chains them: at most 15 of them.
+    for(uint16_t i = count; --i; )
     {
-        sr.set_N(negative16(operand_dst));
-        sr.set_V(overflow16(operand_src, operand_tmp, operand_dst));
+        uint32_t promoted_src = truncate(~operand_src, bw) + carry;
+        uint32_t sum = promoted_src + operand_dst;
+        operand_dst = truncate(sum, bw);
+        carry = (zc || !(bw ? carry8(sum) : carry16(sum))) ? 0 : 1;
+        if(rsrc == rdst)
+            operand_src = same_register_source(operand_dst, bw);
     }
 
-    uint32_t promoted_src = ~operand_src + sr.C;
+    uint16_t operand_tmp = operand_dst;
+
+    operand_dst += ~operand_src + carry;
+
+    uint32_t promoted_src = truncate(~operand_src, bw) + carry;
     uint32_t promoted_dst = operand_tmp;
     uint32_t promoted_result = promoted_src + promoted_dst;
-    if(bw)
-        sr.set_C(carry8(promoted_result));
-    else
-        sr.set_C(carry16(promoted_result));
+    core->flags.record(FLAGS_ARITH, bw, operand_src, operand_tmp, operand_dst, promoted_result);
 
-    doubleop_dest(DM, RB, operand_dst, ad, bw, rdst);
+    doubleop_dest(*core, operand_dst, rdst);
     ac_pc = RB[REG_PC];
 }
 
 //!Instruction CMP behavior method.
 void ac_behavior( CMP )
 {
-    uint16_t operand_src = doubleop_source(DM, RB, as, bw, rsrc);
-    uint16_t operand_dst = doubleop_dest_operand(DM, RB, ad, bw, rdst);
+    TRACE_DOUBLEOP(TRACE_CMP);
+
+    // Every iteration compares the same values.
+    uint16_t zc;
+    repeat_count(*core, as == AM_REGISTER && ad == AM_REGISTER, zc);
+
+    uint16_t operand_src = doubleop_source(*core, rsrc);
+    uint16_t operand_dst = doubleop_dest_operand(*core, rdst);
     uint16_t operand_tmp = operand_dst;
-    sr_flags_t sr(RB);
 
     operand_dst += ~operand_src + 1;
 
-    sr.set_Z(operand_dst == 0);
-    if(bw)
-    {
-        sr.set_N(negative8(operand_dst));
-        sr.set_V(overflow8(operand_src, operand_tmp, operand_dst));
-    }
-    else
-    {
-        sr.set_N(negative16(operand_dst));
-        sr.set_V(overflow16(operand_src, operand_tmp, operand_dst));
-    }
-
     uint32_t promoted_src = ~operand_src + 1;
     uint32_t promoted_dst = operand_tmp;
     uint32_t promoted_result = promoted_src + promoted_dst;
-    if(bw)
-        sr.set_C(carry8(promoted_result));
-    else
-        sr.set_C(carry16(promoted_result));
+    core->flags.record(FLAGS_ARITH, bw, operand_src, operand_tmp, operand_dst, promoted_result);
 
     // Do not change the value
-    doubleop_dest(DM, RB, operand_tmp, ad, bw, rdst);
+    doubleop_dest(*core, operand_tmp, rdst);
     ac_pc = RB[REG_PC];
 }
 
 //!Instruction DADD behavior method.
 void ac_behavior( DADD )
 {
-    std::cerr << "oops (DADD)" << std::endl;
+    TRACE_DOUBLEOP(TRACE_DADD);
+    log_event(*core, LOG_DADD, ac_pc - 2);
 }
 
 //!Instruction BIT behavior method.
 void ac_behavior( BIT )
 {
-    uint16_t operand_src = doubleop_source(DM, RB, as, bw, rsrc);
-    uint16_t operand_dst = doubleop_dest_operand(DM, RB, ad, bw, rdst);
+    TRACE_DOUBLEOP(TRACE_BIT);
+
+    // Every iteration tests the same values.
+    uint16_t zc;
+    repeat_count(*core, as == AM_REGISTER && ad == AM_REGISTER, zc);
+
+    uint16_t operand_src = doubleop_source(*core, rsrc);
+    uint16_t operand_dst = doubleop_dest_operand(*core, rdst);
     uint16_t tmp = operand_dst;
-    sr_flags_t sr(RB);
 
     operand_dst &= operand_src;
-
-    sr.set_Z(operand_dst == 0);
-    sr.set_C(operand_dst != 0);
-    sr.set_V(0);
-    if(bw)
-        sr.set_N(negative8(operand_dst));
-    else
-        sr.set_N(negative16(operand_dst));
+    core->flags.record(FLAGS_LOGIC, bw, operand_src, tmp, operand_dst);
 
     // Do not change the value
-    doubleop_dest(DM, RB, tmp, ad, bw, rdst);
+    doubleop_dest(*core, tmp, rdst);
     ac_pc = RB[REG_PC];
 }
 
 //!Instruction BIC behavior method.
 void ac_behavior( BIC )
 {
-    uint16_t operand_src = doubleop_source(DM, RB, as, bw, rsrc);
-    uint16_t operand_dst = doubleop_dest_operand(DM, RB, ad, bw, rdst);
+    TRACE_DOUBLEOP(TRACE_BIC);
+
+    // Clearing bits again changes nothing.
+    uint16_t zc;
+    repeat_count(*core, as == AM_REGISTER && ad == AM_REGISTER, zc);
+
+    uint16_t operand_src = doubleop_source(*core, rsrc);
+    uint16_t operand_dst = doubleop_dest_operand(*core, rdst);
 
     operand_dst &= ~operand_src;
 
-    doubleop_dest(DM, RB, operand_dst, ad, bw, rdst);
+    doubleop_dest(*core, operand_dst, rdst);
     ac_pc = RB[REG_PC];
 }
 
 //!Instruction BIS behavior method.
 void ac_behavior( BIS )
 {
-    uint16_t operand_src = doubleop_source(DM, RB, as, bw, rsrc);
-    uint16_t operand_dst = doubleop_dest_operand(DM, RB, ad, bw, rdst);
+    TRACE_DOUBLEOP(TRACE_BIS);
+
+    // Setting bits again changes nothing.
+    uint16_t zc;
+    repeat_count(*core, as == AM_REGISTER && ad == AM_REGISTER, zc);
+
+    uint16_t operand_src = doubleop_source(*core, rsrc);
+    uint16_t operand_dst = doubleop_dest_operand(*core, rdst);
 
     operand_dst |= operand_src;
 
-    doubleop_dest(DM, RB, operand_dst, ad, bw, rdst);
+    doubleop_dest(*core, operand_dst, rdst);
     ac_pc = RB[REG_PC];
 }
 
 //!Instruction XOR behavior method.
 void ac_behavior( XOR )
 {
-    uint16_t operand_src = doubleop_source(DM, RB, as, bw, rsrc);
-    uint16_t operand_dst = doubleop_dest_operand(DM, RB, ad, bw, rdst);
-    uint16_t operand_tmp = operand_dst;
-    sr_flags_t sr(RB);
+    TRACE_DOUBLEOP(TRACE_XOR);
 
-    operand_dst ^= operand_src;
+    uint16_t zc;
+    uint16_t count = repeat_count(*core, as == AM_REGISTER && ad == AM_REGISTER, zc);
 
-    sr.set_Z(operand_dst == 0);
-    sr.set_C(operand_dst != 0);
-    if(bw)
-    {
-        sr.set_N(negative8(operand_dst));
-        sr.set_V(negative8(operand_src) && negative8(operand_tmp));
-    }
-    else
+    uint16_t operand_src = doubleop_source(*core, rsrc);
+    uint16_t operand_dst = doubleop_dest_operand(*core, rdst);
+
+    // All iterations but the last one, which sets the flags: they cancel
+    // out two by two.
+    if(count > 1)
     {
-        sr.set_N(negative16(operand_dst));
-        sr.set_V(negative16(operand_src) && negative16(operand_tmp));
+        if(rsrc == rdst)
+            operand_dst = operand_src = 0;
+        else if((count - 1) & 1)
+            operand_dst ^= operand_src;
     }
 
-    doubleop_dest(DM, RB, operand_dst, ad, bw, rdst);
+    uint16_t operand_tmp = operand_dst;
+
+    operand_dst ^= operand_src;
+    core->flags.record(FLAGS_XOR, bw, operand_src, operand_tmp, operand_dst);
+
+    doubleop_dest(*core, operand_dst, rdst);
     ac_pc = RB[REG_PC];
 }
 
 //!Instruction AND behavior method.
 void ac_behavior( AND )
 {
-    uint16_t operand_src = doubleop_source(DM, RB, as, bw, rsrc);
-    uint16_t operand_dst = doubleop_dest_operand(DM, RB, ad, bw, rdst);
-    sr_flags_t sr(RB);
+    TRACE_DOUBLEOP(TRACE_AND);
 
-    operand_dst &= operand_src;
+    // Masking again changes nothing.
+    uint16_t zc;
+    repeat_count(*core, as == AM_REGISTER && ad == AM_REGISTER, zc);
 
-    sr.set_Z(operand_dst == 0);
-    sr.set_C(operand_dst != 0);
-    sr.set_V(0);
-    if(bw)
-        sr.set_N(negative8(operand_dst));
-    else
-        sr.set_N(negative16(operand_dst));
+    uint16_t operand_src = doubleop_source(*core, rsrc);
+    uint16_t operand_dst = doubleop_dest_operand(*core, rdst);
+    uint16_t operand_tmp = operand_dst;
 
-    doubleop_dest(DM, RB, operand_dst, ad, bw, rdst);
+    operand_dst &= operand_src;
+    core->flags.record(FLAGS_LOGIC, bw, operand_src, operand_tmp, operand_dst);
+
+    doubleop_dest(*core, operand_dst, rdst);
     ac_pc = RB[REG_PC];
 }
 
 //!Instruction RRC behavior method.
 void ac_behavior( RRC )
 {
-    std::cerr << "oops (RRC)" << std::endl;
+    TRACE_SIMPLEOP(TRACE_RRC);
+
+    uint16_t zc;
+    uint16_t count = repeat_count(*core, ad == AM_REGISTER, zc);
+    uint32_t address;
+    uint16_t operand = singleop_operand(*core, ad, bw, rdst, address);
+    unsigned int width = bw ? 8 : 16;
+    unsigned int carry = zc ? 0 : core->flags.C(RB);
+
+    // All iterations but the last one, which sets the flags: the carry and
+    // the operand form a (width + 1)-bit ring rotating right, or a plain
+    // shift when the carry is forced to zero.
+    if(count > 1)
+    {
+        if(zc)
+            operand >>= count - 1;
+        else
+        {
+            uint32_t ring = rotate_right(operand | (carry << width), count - 1, width + 1);
+            operand = ring & ((1 << width) - 1);
+            carry = ring >> width;
+        }
+    }
+
+    uint16_t result = (operand >> 1) | (carry << (width - 1));
+    core->flags.record(FLAGS_SHIFT, bw, operand, operand, result, operand & 1);
+
+    singleop_write(*core, bw, rdst, address, result);
+    ac_pc = RB[REG_PC];
 }
 
 //!Instruction RRA behavior method.
 void ac_behavior( RRA )
 {
-    std::cerr << "oops (RRA)" << std::endl;
+    TRACE_SIMPLEOP(TRACE_RRA);
+
+    uint16_t zc;
+    uint16_t count = repeat_count(*core, ad == AM_REGISTER, zc);
+    uint32_t address;
+    uint16_t operand = singleop_operand(*core, ad, bw, rdst, address);
+
+    // All iterations but the last one, which sets the flags
+    if(count > 1)
+    {
+        if(bw)
+            operand = (uint8_t)((int8_t)operand >> (count - 1));
+        else
+            operand = (int16_t)operand >> (count - 1);
+    }
+
+    uint16_t result = bw
+        ? (uint8_t)((int8_t)operand >> 1)
+        : (uint16_t)((int16_t)operand >> 1);
+    core->flags.record(FLAGS_SHIFT, bw, operand, operand, result, operand & 1);
+
+    singleop_write(*core, bw, rdst, address, result);
+    ac_pc = RB[REG_PC];
 }
 
 //!Instruction PUSH behavior method.
 void ac_behavior( PUSH )
 {
-    std::cerr << "oops (PUSH)" << std::endl;
+    TRACE_SIMPLEOP(TRACE_PUSH);
+
+    uint16_t zc;
+    uint16_t count = repeat_count(*core, ad == AM_REGISTER, zc);
+
+    // The source is read before SP moves: PUSH SP pushes the old SP.
+    uint16_t words[16];
+    words[0] = doubleop_source(*core, rdst);
+    for(uint16_t i = 1; i < count; ++i)
+        words[i] = words[0];
+    stack_push(*core, words, count);
+    ac_pc = RB[REG_PC];
+
+    TRACE_SET(core->trace, result, words[0]);
+    TRACE_SET(core->trace, sp_after, RB[REG_SP]);
 }
 
 //!Instruction SWPB behavior method.
 void ac_behavior( SWPB )
 {
-    std::cerr << "oops (SWPB)" << std::endl;
+    TRACE_SIMPLEOP(TRACE_SWPB);
+
+    uint16_t zc;
+    uint16_t count = repeat_count(*core, ad == AM_REGISTER, zc);
+    uint32_t address;
+    uint16_t operand = singleop_operand(*core, ad, bw, rdst, address);
+
+    // Swapping twice changes nothing.
+    if(count & 1)
+        operand = (operand >> 8) | (operand << 8);
+
+    singleop_write(*core, 0, rdst, address, operand);
+    ac_pc = RB[REG_PC];
 }
 
 //!Instruction CALL behavior method.
 void ac_behavior( CALL )
 {
-    uint16_t address = doubleop_source(DM, RB, ad, 0, rdst);
-    RB[REG_SP] -= 2;
-    DM.write(RB[REG_SP], RB[REG_PC]);
+    TRACE_SIMPLEOP(TRACE_CALL);
+
+    uint16_t address = doubleop_source(*core, rdst);
+    TRACE_SET(core->trace, dst_addr, rdst);
+    TRACE_SET(core->trace, result, address);
+
+    // PC already holds the return address.
+    if(call_intrinsic(*core, address))
+    {
+        ac_pc = RB[REG_PC];
+        return;
+    }
+
+    uint16_t return_address = RB[REG_PC];
+    stack_push(*core, &return_address, 1);
     RB[REG_PC] = address;
     ac_pc = RB[REG_PC];
-
-    printf("CALL:\n Rdst=%d\n Ad=%d\n\n", rdst, ad);
+    FUZZ_EDGE(core->fuzz, ac_pc);
+    PROFILE_CALL(core->profile, ac_pc, RB[REG_SP]);
 }
 
 //!Instruction RETI behavior method.
 void ac_behavior( RETI )
 {
-    std::cout << "oops (RETI)" << std::endl;
+    TRACE_SIMPLEOP(TRACE_RETI);
+
+    // Pops what enter_interrupt() pushed. Restoring CPUOFF sends the CPU
+    // back to sleep.
+    uint16_t frame[2];
+    stack_pop(*core, frame, 2);
+    RB[REG_SR] = frame[0] & 0x01ff;
+    core->flags.discard();
+    RB[REG_PC] = frame[1];
+    ac_pc = RB[REG_PC];
+    PROFILE_UNWIND(core->profile, RB[REG_SP]);
+
+    TRACE_SET(core->trace, result, RB[REG_PC]);
+    TRACE_SET(core->trace, sp_after, RB[REG_SP]);
 }
 
 //!Instruction SXT behavior method.
 void ac_behavior( SXT )
 {
-    std::cout << "oops (SXT)" << std::endl;
+    TRACE_SIMPLEOP(TRACE_SXT);
+
+    // Extending again changes nothing.
+    uint16_t zc;
+    repeat_count(*core, ad == AM_REGISTER, zc);
+    uint32_t address;
+    uint16_t operand = singleop_operand(*core, ad, bw, rdst, address);
+    uint16_t result = (int16_t)(int8_t)operand;
+    core->flags.record(FLAGS_LOGIC, 0, operand, operand, result);
+
+    singleop_write(*core, 0, rdst, address, result);
+    ac_pc = RB[REG_PC];
 }
 
 //!Instruction JZ behavior method.
 void ac_behavior( JZ )
 {
-    sr_flags_t sr(RB);
-    if(sr.Z)
-    {
-        int16_t signed_offset = 2 * u10_to_i16(offset);
-        RB[REG_PC] += signed_offset;
-        // TODO: Check whether PC gets incremented by 2 at the end (should be true)
-    }
+    TRACE_SET(core->trace, instr, TRACE_JZ);
+    if(core->flags.Z(RB))
+        take_jump(*core, offset);
     ac_pc = RB[REG_PC];
+    FUZZ_EDGE(core->fuzz, ac_pc);
 }
 
 //!Instruction JNZ behavior method.
 void ac_behavior( JNZ )
 {
-    sr_flags_t sr(RB);
-    if(!sr.Z)
-    {
-        int16_t signed_offset = 2 * u10_to_i16(offset);
-        RB[REG_PC] += signed_offset;
-        // TODO: Check whether PC gets incremented by 2 at the end (should be true)
-    }
+    TRACE_SET(core->trace, instr, TRACE_JNZ);
+    if(!core->flags.Z(RB))
+        take_jump(*core, offset);
     ac_pc = RB[REG_PC];
+    FUZZ_EDGE(core->fuzz, ac_pc);
 }
 
 //!Instruction JC behavior method.
 void ac_behavior( JC )
 {
-    sr_flags_t sr(RB);
-    if(sr.C)
-    {
-        int16_t signed_offset = 2 * u10_to_i16(offset);
-        RB[REG_PC] += signed_offset;
-        // TODO: Check whether PC gets incremented by 2 at the end (should be true)
-    }
+    TRACE_SET(core->trace, instr, TRACE_JC);
+    if(core->flags.C(RB))
+        take_jump(*core, offset);
     ac_pc = RB[REG_PC];
+    FUZZ_EDGE(core->fuzz, ac_pc);
 }
 
 //!Instruction JNC behavior method.
 void ac_behavior( JNC )
 {
-    sr_flags_t sr(RB);
-    if(!sr.C)
-    {
-        int16_t signed_offset = 2 * u10_to_i16(offset);
-        RB[REG_PC] += signed_offset;
-        // TODO: Check whether PC gets incremented by 2 at the end (should be true)
-    }
+    TRACE_SET(core->trace, instr, TRACE_JNC);
+    if(!core->flags.C(RB))
+        take_jump(*core, offset);
     ac_pc = RB[REG_PC];
+    FUZZ_EDGE(core->fuzz, ac_pc);
 }
 
 //!Instruction JN behavior method.
 void ac_behavior( JN )
 {
-    sr_flags_t sr(RB);
-    if(sr.N)
-    {
-        int16_t signed_offset = 2 * u10_to_i16(offset);
-        RB[REG_PC] += signed_offset;
-        // TODO: Check whether PC gets incremented by 2 at the end (should be true)
-    }
+    TRACE_SET(core->trace, instr, TRACE_JN);
+    if(core->flags.N(RB))
+        take_jump(*core, offset);
     ac_pc = RB[REG_PC];
+    FUZZ_EDGE(core->fuzz, ac_pc);
 }
 
 //!Instruction JGE behavior method.
 void ac_behavior( JGE )
 {
-    sr_flags_t sr(RB);
-    if(!(sr.N ^ sr.V))
-    {
-        int16_t signed_offset = 2 * u10_to_i16(offset);
-        RB[REG_PC] += signed_offset;
-        // TODO: Check whether PC gets incremented by 2 at the end (should be true)
-    }
+    TRACE_SET(core->trace, instr, TRACE_JGE);
+    if(!(core->flags.N(RB) ^ core->flags.V(RB)))
+        take_jump(*core, offset);
     ac_pc = RB[REG_PC];
+    FUZZ_EDGE(core->fuzz, ac_pc);
 }
 
 //!Instruction JL behavior method.
 void ac_behavior( JL )
 {
-    sr_flags_t sr(RB);
-    if(sr.N ^ sr.V)
-    {
-        int16_t signed_offset = 2 * u10_to_i16(offset);
-        RB[REG_PC] += signed_offset;
-        // TODO: Check whether PC gets incremented by 2 at the end (should be true)
-    }
+    TRACE_SET(core->trace, instr, TRACE_JL);
+    if(core->flags.N(RB) ^ core->flags.V(RB))
+        take_jump(*core, offset);
     ac_pc = RB[REG_PC];
+    FUZZ_EDGE(core->fuzz, ac_pc);
 }
 
 //!Instruction JMP behavior method.
 void ac_behavior( JMP )
 {
-    int16_t signed_offset = 2 * u10_to_i16(offset);
-    RB[REG_PC] += signed_offset;
+    TRACE_SET(core->trace, instr, TRACE_JMP);
+    take_jump(*core, offset);
     ac_pc = RB[REG_PC];
+    FUZZ_EDGE(core->fuzz, ac_pc);
 }
 
 //!Instruction PUSHPOPM behavior method.
@@ -810,50 +1564,47 @@ void ac_behavior( PUSHPOPM )
     uint16_t n = 1 + n1;
     uint16_t rdst = rdst1 + n1;
 
-    if(!(subop & 0x1))
-        std::cerr << "PUSHPOPM: address mode not supported." << std::endl;
+    TRACE_SET(core->trace, instr, TRACE_PUSHPOPM);
+    TRACE_SET(core->trace, aux, n | (rdst << 8) | (subop << 12));
 
-    std::cout << "PUSHPOP:" << std::endl
-              << " n=" << std::dec << n << std::endl
-              << " rdst=" << rdst << std::endl
-              << " before: SP=" << std::hex << RB[REG_SP] << std::endl;
+    if(!(subop & 0x1))
+        log_event(*core, LOG_PUSHPOPM_A, ac_pc - 2);
 
+    // The registers move as one span: rdst - n + 1 up to rdst for PUSHM,
+    // rdst up to rdst + n - 1 for POPM, from the top of the stack up.
+    uint16_t words[16];
     if(!(subop & 0x2)) // PUSHM
     {
-        std::cout << " It's a pushm!" << std::endl;
-        for(; n; --n, --rdst)
-        {
-            std::cout << "  r" << std::dec << rdst << std::endl;
-            RB[REG_SP] -= 2;
-            DM.write(RB[REG_SP], RB[rdst]);
-        }
+        if(rdst >= REG_SR && rdst - n < REG_SR)
+            core->flags.sync(RB);
+        for(uint16_t i = 0; i < n; ++i)
+            words[i] = RB[(rdst - n + 1 + i) & 0xf];
+        stack_push(*core, words, n);
     }
     else // POPM
     {
-        std::cout << " It's a popm!" << std::endl;
-        for(; n; --n, ++rdst)
-        {
-            std::cout << "  r" << std::dec << rdst << std::endl;
-            RB[rdst] = DM.read(RB[REG_SP]);
-            RB[REG_SP] += 2;
-        }
+        stack_pop(*core, words, n);
+        for(uint16_t i = 0; i < n; ++i)
+            RB[(rdst + i) & 0xf] = words[i];
+        if(rdst <= REG_SR && rdst + n > REG_SR)
+            core->flags.discard();
     }
     ac_pc = RB[REG_PC];
 
-    std::cout << " after: SP=" << std::hex << RB[REG_SP] << std::endl
-              << std::endl;
+    TRACE_SET(core->trace, sp_after, RB[REG_SP]);
 }
 
 //!Instruction EXT behavior method.
 void ac_behavior( EXT )
 {
-    extension.payload_h = payload_h;
-    extension.payload_l = payload_l;
-    extension.al        = al;
-    if(extension.state != EXT_NONE)
-        std::cerr << "Bad extension state (Oops)" << std::endl;
-    extension.state = EXT_RDY;
-
-    std::cout << "Extension!" << std::endl;
+    core->extension.payload_h = payload_h;
+    core->extension.payload_l = payload_l;
+    core->extension.al        = al;
+    if(core->extension.state != EXT_NONE)
+        log_event(*core, LOG_EXT_TWICE, ac_pc - 2);
+    core->extension.state = EXT_RDY;
+
+    TRACE_SET(core->trace, instr, TRACE_EXT);
+    TRACE_SET(core->trace, aux, payload_l | (al << 6) | (payload_h << 7));
 }
 
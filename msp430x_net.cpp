@@ -0,0 +1,152 @@
+/*
+ * Network runner: simulates a network of msp430x nodes in one process, one
+ * processor per node, talking over the radio medium of msp430x_net.H.
+ *
+ * Link this file instead of ArchC's generated main.cpp, like the batch
+ * runner. Every node gets a thread of its own, but at most "-j" of them
+ * run at once.
+ *
+ * Usage: msp430x_net [-j threads] [-l latency] [-b byte_cycles] [-f nodes]
+ *                    [firmware.elf ...]
+ *   Each firmware image on the command line is one node. Each line of the
+ *   nodes file is the command line of one node, as given to the simulator.
+ *   latency (8000 cycles, 1 ms at 8 MHz) is the lookahead of the
+ *   synchronization: the shorter, the more often nodes wait for each other.
+ *   byte_cycles (256) is the air time of a byte.
+ */
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <stdlib.h>
+
+#include "msp430x.H"
+#include "msp430x_batch.H"
+#include "msp430x_net.H"
+
+typedef std::vector<std::string> args_t;
+
+static int run_node(network_t &network, const args_t &args, unsigned int index)
+{
+    std::string name = "node_" + std::to_string(index);
+
+    std::vector<char *> argv;
+    argv.push_back(const_cast<char *>(name.c_str()));
+    for(size_t i = 0; i < args.size(); ++i)
+        argv.push_back(const_cast<char *>(args[i].c_str()));
+    argv.push_back(NULL);
+
+    // init() may run the begin behavior, which attaches the node: enter
+    // first. Nothing under the lock waits for other nodes.
+    net_node_t &node = network.node(index);
+    network.enter(node);
+
+    std::unique_ptr<msp430x> proc;
+    {
+        std::lock_guard<std::mutex> guard(processor_lock());
+        proc.reset(new msp430x(name.c_str()));
+        proc->init(argv.size() - 1, argv.data());
+    }
+
+    proc->behavior();
+    network.leave(node);
+    int status = proc->ac_exit_status;
+
+    std::lock_guard<std::mutex> guard(processor_lock());
+    proc.reset();
+    return status;
+}
+
+static void usage(const char *self)
+{
+    std::cerr << "Usage: " << self << " [-j threads] [-l latency] [-b byte_cycles]"
+              << " [-f nodes] [firmware.elf ...]" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int threads = std::thread::hardware_concurrency();
+    uint64_t latency = 8000, byte_cycles = 256;
+    std::vector<args_t> nodes;
+
+    for(int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if(arg == "-j" && i + 1 < argc)
+            threads = atoi(argv[++i]);
+        else if(arg == "-l" && i + 1 < argc)
+            latency = strtoull(argv[++i], NULL, 0);
+        else if(arg == "-b" && i + 1 < argc)
+            byte_cycles = strtoull(argv[++i], NULL, 0);
+        else if(arg == "-f" && i + 1 < argc)
+        {
+            std::ifstream file(argv[++i]);
+            if(!file)
+            {
+                std::cerr << "Cannot open " << argv[i] << std::endl;
+                return 1;
+            }
+
+            std::string line;
+            while(std::getline(file, line))
+            {
+                std::istringstream words(line);
+                args_t args;
+                std::string word;
+                while(words >> word)
+                    args.push_back(word);
+                if(!args.empty())
+                    nodes.push_back(args);
+            }
+        }
+        else if(arg[0] == '-')
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        else
+            nodes.push_back(args_t(1, "--load=" + arg));
+    }
+
+    if(!threads)
+        threads = 1;
+
+    if(nodes.empty() || !latency)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // Waiting nodes block their thread: one thread per node, and the
+    // network hands out "threads" slots.
+    network_t network(nodes.size(), threads, latency, byte_cycles);
+    batch_pool_t pool(nodes.size());
+    for(size_t i = 0; i < nodes.size(); ++i)
+    {
+        const args_t &args = nodes[i];
+        pool.submit([&network, &args, i]() { return run_node(network, args, i); });
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<int> statuses = pool.run();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    int failed = 0;
+    for(size_t i = 0; i < statuses.size(); ++i)
+    {
+        if(statuses[i])
+        {
+            ++failed;
+            std::cerr << "node " << i << ": exit status " << statuses[i] << std::endl;
+        }
+    }
+
+    std::cerr << nodes.size() << " nodes, " << failed << " failed, "
+              << elapsed.count() << " s on " << threads << " threads" << std::endl;
+    return failed ? 1 : 0;
+}
@@ -13,15 +13,171 @@
  ******************************************************/
  
 
+#include <string.h>
+#include <vector>
+
 #include  "msp430x_syscall.H"
+#include  "msp430x_core.H"
+#include  "msp430x_elf.H"
 
 //!'using namespace' statement to allow access to all msp430x-specific datatypes
 using namespace msp430x_parms;
 
-void msp430x_syscall::get_buffer(int argn, unsigned char* buf, unsigned int size) { }
-void msp430x_syscall::set_buffer(int argn, unsigned char* buf, unsigned int size) { }
-void msp430x_syscall::set_buffer_noinvert(int argn, unsigned char* buf, unsigned int size) { }
-int  msp430x_syscall::get_int(int argn) { }
-void msp430x_syscall::set_int(int argn, int val) { }
-void msp430x_syscall::return_from_syscall() { }
-void msp430x_syscall::set_prog_args(int argc, char **argv) { } 
+typedef msp430x_isa::core_t core_t;
+
+// msp430-elf calling convention: the first four arguments are in R12-R15,
+// the next ones on the stack after the return address. The result goes in
+// R12.
+#define SYSCALL_ARG_REG   12
+#define SYSCALL_ARG_REGS  4
+
+// Argument block of set_prog_args(): right below the initial stack
+// pointer, unless the build names a region the linker script reserves for
+// it (SYSCALL_ARGS_BASE, of SYSCALL_ARGS_SIZE bytes).
+#ifndef SYSCALL_ARGS_SIZE
+#define SYSCALL_ARGS_SIZE 256
+#endif
+
+// Buffers are copied straight from and to the sparse store backing DM, one
+// memcpy per page, instead of going through DM byte by byte.
+static core_t& syscall_core(const void *DM)
+{
+    core_t *core = core_t::of(DM);
+    if(!core)
+    {
+        std::cerr << "Syscall outside of a running processor (Oops)" << std::endl;
+        abort();
+    }
+    return *core;
+}
+
+void msp430x_syscall::get_buffer(int argn, unsigned char* buf, unsigned int size)
+{
+    core_t &core = syscall_core(&DM);
+    core.memory.read_span(buf, (uint16_t)get_int(argn), size);
+}
+
+void msp430x_syscall::set_buffer(int argn, unsigned char* buf, unsigned int size)
+{
+    core_t &core = syscall_core(&DM);
+    uint32_t address = (uint16_t)get_int(argn);
+    core.memory.write_span(address, buf, size);
+    core.decode_cache.invalidate_span(address, size);
+}
+
+// Host and target are both little-endian: nothing to invert either way.
+void msp430x_syscall::set_buffer_noinvert(int argn, unsigned char* buf, unsigned int size)
+{
+    set_buffer(argn, buf, size);
+}
+
+// Arguments are 16-bit ints: negative ones (fds of -1, lseek offsets)
+// reach the host as such. Addresses are cast back to uint16_t.
+int msp430x_syscall::get_int(int argn)
+{
+    if(argn < SYSCALL_ARG_REGS)
+        return (int16_t)RB[SYSCALL_ARG_REG + argn];
+
+    core_t &core = syscall_core(&DM);
+    return (int16_t)core.memory.read_word(RB[REG_SP] + 2 * (1 + argn - SYSCALL_ARG_REGS));
+}
+
+void msp430x_syscall::set_int(int argn, int val)
+{
+    RB[SYSCALL_ARG_REG + argn] = val;
+}
+
+// Syscalls are reached by CALL: pop the return address.
+void msp430x_syscall::return_from_syscall()
+{
+    core_t &core = syscall_core(&DM);
+    RB[REG_PC] = core.memory.read_word(RB[REG_SP]);
+    RB[REG_SP] += 2;
+    ac_pc = RB[REG_PC];
+}
+
+// Initial stack pointer of the image: the __stack symbol that msp430-elf
+// linker scripts put at the end of RAM, and crt0 loads into SP. 0 if the
+// image has none.
+static uint32_t initial_sp(const char *image)
+{
+    elf_symbols_t symbols;
+    if(!image || !symbols.load(image))
+        return 0;
+    return symbols.address_of("__stack");
+}
+
+// Copies argc, argv and the strings into the argument block: argc, the argv
+// pointer, the NULL-terminated argv array, then the strings. As in other
+// ArchC ports, the block sits at the top of the stack, right below the
+// initial SP of the image (argv[0]), and SP starts below it; R12 and R13
+// hold argc and argv for images entered straight at main. crt0 reloads SP
+// from __stack and clobbers R12 and R13: firmware that wants its arguments
+// either keeps the SP it is started with and reads them from 0(SP) and
+// 2(SP), or is built with SYSCALL_ARGS_BASE naming a region its linker
+// script reserves. This may run before the begin behavior, while DM still
+// has ArchC's own storage, which the begin behavior copies.
+void msp430x_syscall::set_prog_args(int argc, char **argv)
+{
+    std::vector<uint8_t> strings;
+    std::vector<size_t> offsets;
+    for(int i = 0; i < argc; ++i)
+    {
+        offsets.push_back(strings.size());
+        strings.insert(strings.end(), argv[i], argv[i] + strlen(argv[i]) + 1);
+    }
+    if(strings.size() & 1)
+        strings.push_back(0);
+    uint32_t size = 4 + 2 * (argc + 1) + strings.size();
+
+#ifdef SYSCALL_ARGS_BASE
+    uint32_t base = SYSCALL_ARGS_BASE;
+    bool fits = size <= SYSCALL_ARGS_SIZE;
+#else
+    uint32_t top = initial_sp(argc ? argv[0] : NULL);
+    uint32_t base = top - size;
+    bool fits = top > DM_FAST_BEGIN && top <= DM_FAST_END && size <= top - DM_FAST_BEGIN;
+    if(!top)
+        std::cerr << "No __stack symbol in the image" << std::endl;
+#endif
+    if(!fits)
+    {
+        std::cerr << "No room for the program arguments, main gets none" << std::endl;
+        RB[SYSCALL_ARG_REG] = 0;
+        RB[SYSCALL_ARG_REG + 1] = 0;
+        return;
+    }
+
+    uint16_t argv_base = base + 4;
+    uint16_t strings_base = argv_base + 2 * (argc + 1);
+    std::vector<uint8_t> block(strings_base - base, 0);
+    block[0] = argc;
+    block[1] = argc >> 8;
+    block[2] = argv_base & 0xff;
+    block[3] = argv_base >> 8;
+    for(int i = 0; i < argc; ++i)
+    {
+        uint16_t pointer = strings_base + offsets[i];
+        block[4 + 2 * i] = pointer;
+        block[4 + 2 * i + 1] = pointer >> 8;
+    }
+    block.insert(block.end(), strings.begin(), strings.end());
+
+    core_t *core = core_t::of(&DM);
+    if(core)
+    {
+        core->memory.write_span(base, block.data(), block.size());
+        core->decode_cache.invalidate_span(base, block.size());
+    }
+    else
+    {
+        for(size_t i = 0; i < block.size(); ++i)
+            DM.write_byte(base + i, block[i]);
+    }
+
+#ifndef SYSCALL_ARGS_BASE
+    RB[REG_SP] = base;
+#endif
+    RB[SYSCALL_ARG_REG] = argc;
+    RB[SYSCALL_ARG_REG + 1] = argv_base;
+}
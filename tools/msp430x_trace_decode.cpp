@@ -0,0 +1,179 @@
+/*
+ * Offline decoder for the binary traces written by a simulator built with
+ * -DMSP430X_TRACE. Prints the same text the simulator used to print on
+ * stdout for every instruction.
+ *
+ * With --diff, compares two traces (e.g. of the switch-based and threaded
+ * interpreters) and prints the first record where they differ.
+ *
+ * Build: g++ -O2 -I.. -o msp430x_trace_decode msp430x_trace_decode.cpp
+ * Usage: msp430x_trace_decode [trace file]   (defaults to msp430x.trace)
+ *        msp430x_trace_decode --diff trace1 trace2
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "msp430x_trace.H"
+
+static bool is_doubleop(uint8_t instr)
+{
+    return instr >= TRACE_MOV && instr <= TRACE_AND;
+}
+
+static void print_dest(const trace_record_t &r)
+{
+    printf(" -> ");
+    if(r.flags & TRACE_DST_REG)
+        printf("r%u", r.dst_addr);
+    else if(r.flags & TRACE_DST_MEM)
+        printf("%x", r.dst_addr);
+    printf("\n");
+}
+
+static void print_record(const trace_record_t &r)
+{
+    printf("\npc=%x\nsp=%x\n", r.pc, r.sp);
+
+    if(is_doubleop(r.instr))
+    {
+        unsigned int as = r.aux & 0x3;
+        unsigned int ad = (r.aux >> 2) & 0x1;
+        unsigned int count = r.aux >> 8;
+
+        if(r.instr == TRACE_MOV)
+            printf("MOV\n as=%u\n ad=%u\n", as, ad);
+        else if(r.flags & TRACE_EXTENDED)
+            printf("Extended %s\n %u times\n", trace_instr_names[r.instr], count);
+
+        if(r.instr == TRACE_DADD)
+            return;
+
+        if(r.flags & TRACE_SRC_MEM)
+            printf("@%x\n", r.src_addr);
+        if(r.instr == TRACE_MOV)
+            printf("%x", r.src);
+        print_dest(r);
+        return;
+    }
+
+    switch(r.instr)
+    {
+        case TRACE_CALL:
+            printf("CALL:\n Rdst=%u\n Ad=%u\n\n", r.dst_addr, r.aux & 0x3);
+            break;
+
+        case TRACE_PUSHPOPM:
+        {
+            unsigned int n = r.aux & 0xff;
+            unsigned int rdst = (r.aux >> 8) & 0xf;
+            bool popm = (r.aux >> 12) & 0x2;
+
+            printf("PUSHPOP:\n n=%u\n rdst=%u\n before: SP=%x\n", n, rdst, r.sp);
+            printf(popm ? " It's a popm!\n" : " It's a pushm!\n");
+            for(; n; --n)
+            {
+                printf("  r%u\n", rdst);
+                rdst = popm ? rdst + 1 : rdst - 1;
+            }
+            printf(" after: SP=%x\n\n", r.sp_after);
+            break;
+        }
+
+        case TRACE_EXT:
+            printf("Extension!\n");
+            break;
+
+        default:
+            break;
+    }
+}
+
+static FILE* open_trace(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if(!file)
+    {
+        perror(path);
+        return NULL;
+    }
+
+    trace_file_header_t header;
+    if(fread(&header, sizeof(header), 1, file) != 1
+    || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic))
+    || header.version != TRACE_VERSION
+    || header.record_size != sizeof(trace_record_t))
+    {
+        fprintf(stderr, "%s: not a msp430x trace (version %d)\n", path, TRACE_VERSION);
+        fclose(file);
+        return NULL;
+    }
+    return file;
+}
+
+static int diff(const char *path1, const char *path2)
+{
+    FILE *file1 = open_trace(path1);
+    FILE *file2 = open_trace(path2);
+    if(!file1 || !file2)
+        return 2;
+
+    trace_record_t r1, r2;
+    unsigned long index = 0;
+    int status = 0;
+    for(;; ++index)
+    {
+        bool more1 = fread(&r1, sizeof(r1), 1, file1) == 1;
+        bool more2 = fread(&r2, sizeof(r2), 1, file2) == 1;
+        if(!more1 && !more2)
+            break;
+
+        if(more1 != more2)
+        {
+            printf("%s ends at record %lu\n", more1 ? path2 : path1, index);
+            status = 1;
+            break;
+        }
+
+        if(memcmp(&r1, &r2, sizeof(r1)))
+        {
+            printf("Records %lu differ.\n%s:", index, path1);
+            print_record(r1);
+            printf("\n%s:", path2);
+            print_record(r2);
+            status = 1;
+            break;
+        }
+    }
+
+    if(!status)
+        printf("%lu records, identical\n", index);
+    fclose(file1);
+    fclose(file2);
+    return status;
+}
+
+int main(int argc, char **argv)
+{
+    if(argc > 1 && !strcmp(argv[1], "--diff"))
+    {
+        if(argc != 4)
+        {
+            fprintf(stderr, "Usage: %s --diff trace1 trace2\n", argv[0]);
+            return 2;
+        }
+        return diff(argv[2], argv[3]);
+    }
+
+    const char *path = argc > 1 ? argv[1] : "msp430x.trace";
+    FILE *file = open_trace(path);
+    if(!file)
+        return 1;
+
+    trace_record_t r;
+    while(fread(&r, sizeof(r), 1, file) == 1)
+        print_record(r);
+
+    fclose(file);
+    return 0;
+}